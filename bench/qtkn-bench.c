@@ -0,0 +1,814 @@
+/* qtkn-bench.c
+ *
+ * Copyright 2023, Colin Leroy-Mira <colin@colino.net>
+ *
+ * Microbenchmarks for the QTKN decoder's hot kernels.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "quicktake1x0.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#define WIDTH  320
+#define HEIGHT 240
+
+/* Hardware counters, read through perf_event_open when available.
+ * Otherwise we only report wall-clock time. */
+#define N_COUNTERS 4
+static const char *counter_names[N_COUNTERS] = {
+  "cycles", "instructions", "branch_misses", "l1d_misses"
+};
+static int counter_fd[N_COUNTERS] = { -1, -1, -1, -1 };
+static int counter_idx[N_COUNTERS];
+static int n_open = 0;
+
+static double bench_ns;
+static struct timespec bench_ts;
+
+/* Cost of one empty bench_start()/bench_stop() pair, subtracted for
+ * every pair a kernel used. */
+static unsigned long bench_calls;
+static double overhead_ns, overhead_hw[N_COUNTERS];
+
+struct result {
+  const char *kernel;
+  const char *input;
+  unsigned long ops;
+  double ns;
+  long long hw[N_COUNTERS];
+};
+
+#define MAX_RESULTS 32
+static struct result results[MAX_RESULTS];
+static int n_results = 0;
+
+/* Keep the compiler from optimizing the kernels out */
+static volatile unsigned char sink;
+
+static void perf_open(void) {
+#ifdef __linux__
+  static const struct { unsigned int type; unsigned long long config; } events[N_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                          | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  };
+  struct perf_event_attr attr;
+  int i;
+
+  for (i = 0; i < N_COUNTERS; i++) {
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = (n_open == 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    counter_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+                            n_open ? counter_fd[0] : -1, 0);
+    if (counter_fd[i] < 0) {
+      if (i == 0) {
+        printf("# perf_event_open: %s, using wall-clock time only\n", strerror(errno));
+        return;
+      }
+      continue;
+    }
+    counter_idx[i] = n_open++;
+  }
+#endif
+}
+
+static void bench_begin(void) {
+  bench_ns = 0;
+  bench_calls = 0;
+#ifdef __linux__
+  if (n_open)
+    ioctl(counter_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void bench_start(void) {
+  bench_calls++;
+  clock_gettime(CLOCK_MONOTONIC, &bench_ts);
+#ifdef __linux__
+  if (n_open)
+    ioctl(counter_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void bench_stop(void) {
+  struct timespec now;
+
+#ifdef __linux__
+  if (n_open)
+    ioctl(counter_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bench_ns += (now.tv_sec - bench_ts.tv_sec) * 1e9
+            + (now.tv_nsec - bench_ts.tv_nsec);
+}
+
+static void bench_end(struct result *res) {
+  unsigned long long values[1 + N_COUNTERS];
+  int i;
+
+  res->ns = MAX(bench_ns - bench_calls * overhead_ns, 0);
+  for (i = 0; i < N_COUNTERS; i++) {
+    res->hw[i] = -1;
+  }
+  if (n_open == 0 || read(counter_fd[0], values, sizeof values) < (ssize_t)sizeof(values[0]))
+    return;
+
+  for (i = 0; i < N_COUNTERS; i++) {
+    if (counter_fd[i] >= 0 && counter_idx[i] < (int)values[0])
+      res->hw[i] = MAX((long long)(values[1 + counter_idx[i]]
+                                   - bench_calls * overhead_hw[i]), 0);
+  }
+}
+
+/* Measure the overhead of the timers themselves, keeping the lowest of
+ * a few rounds so we never subtract more than they cost. */
+#define CALIBRATION_CALLS  10000
+#define CALIBRATION_ROUNDS 5
+static void bench_calibrate(void) {
+  double min_ns = -1, min_hw[N_COUNTERS];
+  struct result res;
+  int round, i;
+
+  for (round = 0; round < CALIBRATION_ROUNDS; round++) {
+    bench_begin();
+    for (i = 0; i < CALIBRATION_CALLS; i++) {
+      bench_start();
+      bench_stop();
+    }
+    bench_end(&res);
+
+    if (min_ns < 0 || res.ns < min_ns)
+      min_ns = res.ns;
+    for (i = 0; i < N_COUNTERS; i++) {
+      double v = MAX(res.hw[i], 0);
+      if (round == 0 || v < min_hw[i])
+        min_hw[i] = v;
+    }
+  }
+
+  /* Only set now, bench_end() already subtracts them */
+  overhead_ns = min_ns / CALIBRATION_CALLS;
+  for (i = 0; i < N_COUNTERS; i++) {
+    overhead_hw[i] = min_hw[i] / CALIBRATION_CALLS;
+  }
+  printf("# timer overhead: %.1f ns per start/stop pair\n", overhead_ns);
+}
+
+/* Inputs. Payloads are concatenated; the Huffman decoders can not run on
+ * arbitrary bits, so their calls are recorded while walking each picture's
+ * tokens, and replayed from a stream of the codes they consumed. */
+struct stream {
+  unsigned char *bits;
+  size_t nbits, alloc;
+  unsigned char *tables;
+  unsigned long n, tables_alloc;
+};
+
+struct input {
+  const char *name;
+  unsigned char *buf;
+  size_t len;
+  size_t *starts;
+  int n_pictures;
+  struct stream ctrl, data;
+  unsigned short *scales;
+  unsigned long n_scales, scales_alloc;
+};
+
+static void start_input(const unsigned char *buf, size_t len) {
+  input_buffer = (unsigned char *)buf;
+  input_end = (unsigned char *)buf + len;
+  input_overrun = 0;
+  vbits = 0;
+}
+
+static const unsigned char *rec_start;
+static struct stream *rec_ctrl, *rec_data;
+static int rec_error;
+
+static size_t bit_pos(void) {
+  return (input_buffer - rec_start) * 8 - vbits;
+}
+
+static int stream_add(struct stream *s, unsigned char table, size_t from, size_t to) {
+  if ((s->nbits + (to - from)) / 8 + 1 > s->alloc) {
+    unsigned char *tmp;
+    size_t new_alloc = s->alloc ? s->alloc * 2 : 4096;
+
+    tmp = realloc(s->bits, new_alloc);
+    if (tmp == NULL)
+      return -ENOMEM;
+    memset(tmp + s->alloc, 0, new_alloc - s->alloc);
+    s->bits = tmp;
+    s->alloc = new_alloc;
+  }
+  if (s->n == s->tables_alloc) {
+    unsigned char *tmp;
+    unsigned long new_alloc = s->tables_alloc ? s->tables_alloc * 2 : 4096;
+
+    tmp = realloc(s->tables, new_alloc);
+    if (tmp == NULL)
+      return -ENOMEM;
+    s->tables = tmp;
+    s->tables_alloc = new_alloc;
+  }
+
+  s->tables[s->n++] = table;
+  for (; from < to; from++, s->nbits++) {
+    if ((rec_start[from >> 3] >> (7 - (from & 7))) & 1)
+      s->bits[s->nbits >> 3] |= 0x80 >> (s->nbits & 7);
+  }
+  return 0;
+}
+
+static unsigned char rec_ctrlhuff(unsigned char table) {
+  size_t from = bit_pos();
+  unsigned char val = getctrlhuff(table);
+
+  if (stream_add(rec_ctrl, table, from, bit_pos()) < 0)
+    rec_error = -ENOMEM;
+  return val;
+}
+
+static unsigned char rec_datahuff(unsigned char table) {
+  size_t from = bit_pos();
+  unsigned char val = getdatahuff(table);
+
+  if (stream_add(rec_data, table, from, bit_pos()) < 0)
+    rec_error = -ENOMEM;
+  return val;
+}
+
+/* Walk the tokens of one line, like decode_row() or discard_data() do */
+static void record_line(int discard) {
+  int col = WIDTH / 2, tree = 1, nreps, steps;
+
+  while (col > 0) {
+    if ((tree = rec_ctrlhuff(tree * 2))) {
+      col--;
+      if (tree == 8) {
+        getdatahuff8();
+        getdatahuff8();
+        getdatahuff8();
+        getdatahuff8();
+      } else {
+        rec_datahuff(tree + 1);
+        rec_datahuff(tree + 1);
+        rec_datahuff(tree + 1);
+        rec_datahuff(tree + 1);
+      }
+    } else {
+      do {
+        nreps = (col > 1) ? rec_datahuff(0) + 1 : 1;
+        steps = MIN(nreps, 8);
+        /* decode_row() stops at the end of the line, discard_data() doesn't */
+        if (!discard)
+          steps = MIN(steps, col);
+        col -= steps;
+        for (steps /= 2; steps; steps--) {
+          rec_datahuff(1);
+        }
+      } while (nreps == 9);
+    }
+  }
+}
+
+static void record_scale(struct input *in, unsigned short val) {
+  if (in->n_scales == in->scales_alloc) {
+    unsigned short *tmp;
+    unsigned long new_alloc = in->scales_alloc ? in->scales_alloc * 2 : 256;
+
+    tmp = realloc(in->scales, new_alloc * sizeof(unsigned short));
+    if (tmp == NULL) {
+      rec_error = -ENOMEM;
+      return;
+    }
+    in->scales = tmp;
+    in->scales_alloc = new_alloc;
+  }
+  in->scales[in->n_scales++] = val;
+}
+
+static int record_picture(struct input *in, const unsigned char *buf, size_t len) {
+  int row;
+
+  /* For the Huffman tables */
+  init_decoder();
+
+  start_input(buf, len);
+  rec_start = buf;
+  rec_ctrl = &in->ctrl;
+  rec_data = &in->data;
+  rec_error = 0;
+  initbithuff();
+
+  for (row = 0; row < HEIGHT && !input_overrun && !rec_error; row += 2) {
+    unsigned char mul = getbits6();
+    getbits6();
+    getbits6();
+    record_scale(in, row_scale(mul));
+    record_line(0);
+    record_line(0);
+    record_line(1);
+    record_line(1);
+  }
+  input_end = NULL;
+
+  finalize_decoder(NULL);
+
+  if (rec_error)
+    printf("Can not record the Huffman codes: %s\n", strerror(-rec_error));
+  return rec_error;
+}
+
+static int add_picture(struct input *in, const unsigned char *data, size_t len) {
+  unsigned char *buf;
+  size_t *starts;
+
+  buf = realloc(in->buf, in->len + len);
+  starts = realloc(in->starts, (in->n_pictures + 2) * sizeof(size_t));
+  if (buf == NULL || starts == NULL)
+    return -ENOMEM;
+
+  memcpy(buf + in->len, data, len);
+  in->buf = buf;
+  in->starts = starts;
+  in->starts[in->n_pictures++] = in->len;
+  in->len += len;
+  in->starts[in->n_pictures] = in->len;
+
+  return record_picture(in, data, len);
+}
+
+static void free_input(struct input *in) {
+  free(in->buf);
+  free(in->starts);
+  free(in->ctrl.bits);
+  free(in->ctrl.tables);
+  free(in->data.bits);
+  free(in->data.tables);
+  free(in->scales);
+}
+
+static int load_picture(struct input *in, const char *path) {
+  unsigned char *buf;
+  size_t data_offset;
+  long size;
+  FILE *fp;
+  int r = -EINVAL;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    printf("Can not open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+
+  buf = malloc(size);
+  if (buf != NULL && fread(buf, 1, size, fp) == (size_t)size
+   && qtk_header_valid(buf, size, &data_offset) == 0) {
+    r = add_picture(in, buf + data_offset, size - data_offset);
+  } else {
+    printf("%s is not a Quicktake 150 picture.\n", path);
+  }
+  free(buf);
+  fclose(fp);
+  return r;
+}
+
+/* Synthetic bitstream, built so that every token takes the shortest path
+ * through the Huffman tables and decode_row() time is dominated by the
+ * predictor arithmetic: the ctrl code selects tree 1, whose data table
+ * has 1-bit codes. Tokens alternate between -3 and +3 so that values
+ * stay in range. */
+static unsigned char *synth_ptr;
+static int synth_bits;
+
+static void put_bits(unsigned int val, int n) {
+  while (n--) {
+    *synth_ptr = (*synth_ptr << 1) | ((val >> n) & 1);
+    if (++synth_bits == 8) {
+      synth_bits = 0;
+      synth_ptr++;
+    }
+  }
+}
+
+/* Make sure the decoder reads the synthetic stream the way it was built:
+ * the right scale on every row, and exactly all of it. */
+static int check_synthetic(const unsigned char *buf, size_t len) {
+  int row, r = 0;
+
+  start_input(buf, len);
+  init_decoder();
+  initbithuff();
+
+  for (row = 0; row < HEIGHT; row += 2) {
+    output_line = output + (row - 1) * WIDTH;
+    if (init_row() < 0 || mul_m != 16) {
+      printf("Synthetic stream out of sync at row %d.\n", row);
+      r = -EINVAL;
+      break;
+    }
+    decode_row();
+    discard_data();
+  }
+  if (r == 0 && (input_overrun || input_buffer != buf + len)) {
+    printf("Synthetic stream read %ld bytes out of %zu.\n",
+           (long)(input_buffer - buf), len);
+    r = -EINVAL;
+  }
+  input_end = NULL;
+  finalize_decoder(NULL);
+  return r;
+}
+
+static int build_synthetic(struct input *in) {
+  /* init_row: 18 bits, then four lines of 160 pairs of 6 bits */
+  size_t len = (HEIGHT / 2 * (18 + 4 * WIDTH / 2 * 6) + 7) / 8;
+  unsigned char *buf = calloc(1, len);
+  int row, line, col, r;
+
+  if (buf == NULL)
+    return -ENOMEM;
+
+  synth_ptr = buf;
+  synth_bits = 0;
+  for (row = 0; row < HEIGHT; row += 2) {
+    put_bits(16, 6);   /* mul_m */
+    put_bits(0, 12);
+    for (line = 0; line < 4; line++) {
+      for (col = 0; col < WIDTH / 2; col++) {
+        put_bits(0x2, 2);   /* ctrl: tree 1 */
+        put_bits(0x5, 4);   /* -3, +3, -3, +3 */
+      }
+    }
+  }
+  if (synth_bits)
+    *synth_ptr <<= 8 - synth_bits;
+
+  r = check_synthetic(buf, len);
+  if (r == 0)
+    r = add_picture(in, buf, len);
+  free(buf);
+  return r;
+}
+
+/* Kernels. Each one returns the number of operations it ran. */
+
+static unsigned long run_getbit(const struct input *in) {
+  unsigned long n = 0;
+  unsigned char acc = 0;
+
+  start_input(in->buf, in->len);
+  bench_start();
+  while (!input_overrun) {
+    acc += getbit();
+    n++;
+  }
+  bench_stop();
+  sink = acc;
+  return n;
+}
+
+static unsigned long run_getbits6(const struct input *in) {
+  unsigned long n = 0;
+  unsigned char acc = 0;
+
+  start_input(in->buf, in->len);
+  bench_start();
+  while (!input_overrun) {
+    acc += getbits6();
+    n++;
+  }
+  bench_stop();
+  sink = acc;
+  return n;
+}
+
+static unsigned long run_getctrlhuff(const struct input *in) {
+  const struct stream *s = &in->ctrl;
+  unsigned long n;
+  unsigned char acc = 0;
+
+  start_input(s->bits, s->alloc);
+  bench_start();
+  for (n = 0; n < s->n; n++) {
+    acc += getctrlhuff(s->tables[n]);
+  }
+  bench_stop();
+  sink = acc;
+  return n;
+}
+
+static unsigned long run_getdatahuff(const struct input *in) {
+  const struct stream *s = &in->data;
+  unsigned long n;
+  unsigned char acc = 0;
+
+  start_input(s->bits, s->alloc);
+  bench_start();
+  for (n = 0; n < s->n; n++) {
+    acc += getdatahuff(s->tables[n]);
+  }
+  bench_stop();
+  sink = acc;
+  return n;
+}
+
+static unsigned long run_getdatahuff8(const struct input *in) {
+  unsigned long n = 0;
+  unsigned char acc = 0;
+
+  start_input(in->buf, in->len);
+  bench_start();
+  while (!input_overrun) {
+    acc += getdatahuff8();
+    n++;
+  }
+  bench_stop();
+  sink = acc;
+  return n;
+}
+
+/* Replay the scales init_row() applied to each picture's rows. One
+ * operation is a whole next_line rescale. */
+#define RESCALE_PASSES 100
+
+static unsigned long run_rescale(const struct input *in) {
+  unsigned long n = 0, i;
+  int pass;
+
+  for (pass = 0; pass < RESCALE_PASSES; pass++) {
+    /* Resets next_line */
+    init_decoder();
+
+    bench_start();
+    for (i = 0; i < in->n_scales; i++) {
+      rescale_next_line(in->scales[i]);
+    }
+    bench_stop();
+    n += in->n_scales;
+
+    finalize_decoder(NULL);
+  }
+  return n;
+}
+
+/* Only decode_row() is measured, one operation is one output pixel.
+ * It's timed once per row pair, bench_end() subtracts the timers' cost. */
+static unsigned long run_decode_row(const struct input *in) {
+  unsigned long n = 0;
+  int i, row;
+
+  for (i = 0; i < in->n_pictures; i++) {
+    start_input(in->buf + in->starts[i], in->starts[i + 1] - in->starts[i]);
+    init_decoder();
+    initbithuff();
+
+    for (row = 0; row < HEIGHT && !input_overrun; row += 2) {
+      output_line = output + (row - 1) * WIDTH;
+      if (init_row() < 0)
+        break;
+
+      bench_start();
+      decode_row();
+      bench_stop();
+      n += 2 * WIDTH;
+
+      discard_data();
+    }
+    finalize_decoder(NULL);
+  }
+  return n;
+}
+
+struct kernel {
+  const char *name;
+  unsigned long (*run)(const struct input *in);
+};
+
+static const struct kernel kernels[] = {
+  { "getbit",       run_getbit },
+  { "getbits6",     run_getbits6 },
+  { "getctrlhuff",  run_getctrlhuff },
+  { "getdatahuff",  run_getdatahuff },
+  { "getdatahuff8", run_getdatahuff8 },
+  { "rescale",      run_rescale },
+  { "decode_row",   run_decode_row },
+};
+
+static void run_kernel(const struct kernel *k, const struct input *in, int reps) {
+  struct result best, res;
+  int rep;
+
+  best.ns = -1;
+  for (rep = 0; rep < reps; rep++) {
+    bench_begin();
+    res.ops = k->run(in);
+    bench_end(&res);
+    if (best.ns < 0 || res.ns < best.ns)
+      best = res;
+  }
+  input_end = NULL;
+
+  if (n_results == MAX_RESULTS || best.ops == 0)
+    return;
+  best.kernel = k->name;
+  best.input = in->name;
+  results[n_results++] = best;
+}
+
+/* Results file: one "kernel input metric value" line per measure. */
+static void write_results(FILE *fp) {
+  int i, c;
+
+  fprintf(fp, "# kernel input metric value\n");
+  for (i = 0; i < n_results; i++) {
+    struct result *res = &results[i];
+
+    fprintf(fp, "%s %s ns_per_op %.4f\n", res->kernel, res->input, res->ns / res->ops);
+    for (c = 0; c < N_COUNTERS; c++) {
+      if (res->hw[c] >= 0)
+        fprintf(fp, "%s %s %s_per_op %.4f\n", res->kernel, res->input,
+                counter_names[c], (double)res->hw[c] / res->ops);
+    }
+  }
+}
+
+/* Find a measure in the current results */
+static int current_value(const char *kernel, const char *input,
+                         const char *metric, double *val) {
+  int i, c;
+
+  for (i = 0; i < n_results; i++) {
+    struct result *res = &results[i];
+
+    if (strcmp(res->kernel, kernel) || strcmp(res->input, input))
+      continue;
+
+    if (!strcmp(metric, "ns_per_op")) {
+      *val = res->ns / res->ops;
+      return 0;
+    }
+    for (c = 0; c < N_COUNTERS; c++) {
+      if (res->hw[c] >= 0 && !strncmp(metric, counter_names[c], strlen(counter_names[c]))
+       && !strcmp(metric + strlen(counter_names[c]), "_per_op")) {
+        *val = (double)res->hw[c] / res->ops;
+        return 0;
+      }
+    }
+  }
+  return -ENOENT;
+}
+
+/* Compare the current results against a baseline, and return the number
+ * of measures that regressed by more than threshold percent. */
+static int compare_results(const char *path, double threshold) {
+  char kernel[64], input[64], metric[64], line[256];
+  double old_val, cur_val;
+  int regressions = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    printf("Can not open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  while (fgets(line, sizeof line, fp)) {
+    if (line[0] == '#'
+     || sscanf(line, "%63s %63s %63s %lf", kernel, input, metric, &old_val) != 4
+     || current_value(kernel, input, metric, &cur_val) < 0)
+      continue;
+
+    /* Ignore noise on counters that almost never trigger */
+    if (old_val < 0.01 && cur_val < 0.01)
+      continue;
+
+    if (cur_val > old_val * (1.0 + threshold / 100.0)) {
+      printf("REGRESSION %s %s %s: %.4f -> %.4f (%+.1f%%)\n",
+             kernel, input, metric, old_val, cur_val,
+             old_val > 0 ? (cur_val - old_val) * 100.0 / old_val : 100.0);
+      regressions++;
+    }
+  }
+
+  fclose(fp);
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  struct input inputs[2];
+  const char *out_path = NULL, *baseline_path = NULL;
+  double threshold = 5.0;
+  int reps = 5, n_inputs = 0, opt, i, k, r = 0;
+  FILE *out_fp;
+
+  while ((opt = getopt(argc, argv, "o:c:t:r:")) != -1) {
+    switch (opt) {
+      case 'o': out_path = optarg; break;
+      case 'c': baseline_path = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      case 'r': reps = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-r reps] [-o results.txt] [-c baseline.txt] [-t threshold%%] [picture.qtk ...]\n", argv[0]);
+        printf("  -o writes the results, to be used later as a baseline.\n");
+        printf("  -c compares with a baseline, and fails if a measure regressed by\n");
+        printf("     more than the threshold (default 5%%).\n");
+        exit(1);
+    }
+  }
+
+  memset(inputs, 0, sizeof inputs);
+  if (optind < argc) {
+    inputs[n_inputs].name = "qt150";
+    for (i = optind; i < argc; i++) {
+      if (load_picture(&inputs[n_inputs], argv[i]) < 0)
+        exit(1);
+    }
+    n_inputs++;
+  }
+  inputs[n_inputs].name = "synthetic";
+  if (build_synthetic(&inputs[n_inputs]) < 0)
+    exit(1);
+  n_inputs++;
+
+  perf_open();
+  bench_calibrate();
+
+  for (i = 0; i < n_inputs; i++) {
+    for (k = 0; k < (int)(sizeof kernels / sizeof kernels[0]); k++) {
+      run_kernel(&kernels[k], &inputs[i], reps);
+    }
+  }
+
+  write_results(stdout);
+
+  if (out_path != NULL) {
+    out_fp = fopen(out_path, "w");
+    if (out_fp == NULL) {
+      printf("Can not open %s: %s\n", out_path, strerror(errno));
+      exit(1);
+    }
+    write_results(out_fp);
+    fclose(out_fp);
+  }
+
+  if (baseline_path != NULL) {
+    r = compare_results(baseline_path, threshold);
+    if (r < 0)
+      exit(1);
+    if (r == 0)
+      printf("No regression above %.1f%%.\n", threshold);
+  }
+
+  for (i = 0; i < n_inputs; i++) {
+    free_input(&inputs[i]);
+  }
+  for (k = 0; k < N_COUNTERS; k++) {
+    if (counter_fd[k] >= 0)
+      close(counter_fd[k]);
+  }
+
+  return r ? 1 : 0;
+}
@@ -22,33 +22,140 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "quicktake1x0.h"
 
-static int get_uint16_at(const unsigned char *buf, size_t offset) {
-  return (buf[offset] << 8) | buf[offset+1];
+struct stream_out {
+  FILE *fp;
+  int lines;
+};
+
+static void write_line(const unsigned char *line, int row, int width, void *data) {
+  struct stream_out *out = data;
+
+  fwrite(line, 1, width, out->fp);
+  fflush(out->fp);
+  out->lines++;
+}
+
+/* Decode the picture while it's being read, writing each line as soon
+ * as it's available. Input can be a pipe or a serial line. */
+static int decode_stream(FILE *in_fp, FILE *out_fp) {
+  static const unsigned char blank[320];
+  unsigned char hdr[738], chunk[256];
+  struct stream_out out = { out_fp, 0 };
+  char *ppm_header;
+  size_t data_offset, len;
+  int r = QTKN_NEED_MORE_DATA;
+
+  if (fread(hdr, 1, sizeof hdr, in_fp) < sizeof hdr
+   || qtk_header_valid(hdr, sizeof hdr, &data_offset) < 0) {
+    printf("File is not a Quicktake 150 picture.\n");
+    return -EINVAL;
+  }
+
+  ppm_header = qtk_ppm_header(320, 240);
+  if (ppm_header == NULL) {
+    return -ENOMEM;
+  }
+  fputs(ppm_header, out_fp);
+  free(ppm_header);
+
+  qtkn_stream_init();
+  r = qtkn_stream_push(hdr + data_offset, sizeof hdr - data_offset, write_line, &out);
+
+  while (r == QTKN_NEED_MORE_DATA && (len = fread(chunk, 1, sizeof chunk, in_fp)) > 0) {
+    r = qtkn_stream_push(chunk, len, write_line, &out);
+  }
+
+  if (qtkn_stream_finish(NULL) < 0 || r < 0) {
+    if (r < 0) {
+      printf("Picture is corrupt.\n");
+    } else {
+      printf("Picture is truncated.\n");
+    }
+    /* Keep the file consistent with its header */
+    for (; out.lines < 240; out.lines++) {
+      fwrite(blank, 1, sizeof blank, out_fp);
+    }
+    return r < 0 ? r : -ENODATA;
+  }
+  return 0;
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [-i] [-g gamma] [-b black] [-w white] [-s sharpen] [input.qtk] [output.ppm]\n", name);
+  printf("       %s -x [-j jobs] [options] [dump.bin] [output_prefix]\n", name);
+  printf("  sharpen goes from -8 (smooth) to 16 (sharpen), 0 to disable.\n");
+  printf("  -x finds and decodes every picture in a raw memory dump.\n");
+  printf("  -i decodes while reading, use - to read from stdin.\n");
 }
 
 int main(int argc, char *argv[]) {
   FILE *in_fp = NULL, *out_fp = NULL;
   unsigned char *in_buf = NULL, *out_buf = NULL;
   size_t in_size = 0, data_offset;
-  unsigned int width, height, type;
+  float gamma = 1.0;
+  int black = 0, white = 255, sharpen = 0;
+  int carve = 0, stream = 0, jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt, r, ret = 0;
+
+  while ((opt = getopt(argc, argv, "g:b:w:s:xj:i")) != -1) {
+    switch (opt) {
+      case 'g': gamma = atof(optarg); break;
+      case 'b': black = atoi(optarg); break;
+      case 'w': white = atoi(optarg); break;
+      case 's': sharpen = atoi(optarg); break;
+      case 'x': carve = 1; break;
+      case 'j': jobs = atoi(optarg); break;
+      case 'i': stream = 1; break;
+      default: usage(argv[0]); goto done;
+    }
+  }
+
+  if (argc - optind < 2) {
+    usage(argv[0]);
+    goto done;
+  }
+
+  if (qtkn_set_tone_curve(gamma, black, white) < 0) {
+    printf("Invalid tone curve settings.\n");
+    goto done;
+  }
+  if (qtkn_set_sharpen(sharpen) < 0) {
+    printf("Invalid sharpen setting.\n");
+    goto done;
+  }
 
-  if (argc < 2) {
-    printf("Usage: %s [input.qtk] [output.ppm]\n", argv[0]);
+  if (carve) {
+    if (qtk_carve_file(argv[optind], argv[optind + 1], jobs) < 0) {
+      printf("Error carving pictures.\n");
+      ret = 1;
+    }
     goto done;
   }
 
-  in_fp = fopen(argv[1], "r");
+  if (stream && !strcmp(argv[optind], "-")) {
+    in_fp = stdin;
+  } else {
+    in_fp = fopen(argv[optind], "r");
+  }
   if (!in_fp) {
-    printf("Can not open %s: %s\n", argv[1], strerror(errno));
+    printf("Can not open %s: %s\n", argv[optind], strerror(errno));
     goto done;
   }
 
-  out_fp = fopen(argv[2], "wb");
+  out_fp = fopen(argv[optind + 1], "wb");
   if (!out_fp) {
-    printf("Can not open %s: %s\n", argv[2], strerror(errno));
+    printf("Can not open %s: %s\n", argv[optind + 1], strerror(errno));
+    goto done;
+  }
+
+  if (stream) {
+    if (decode_stream(in_fp, out_fp) < 0) {
+      ret = 1;
+    }
     goto done;
   }
 
@@ -66,42 +173,35 @@ int main(int argc, char *argv[]) {
     goto done;
   }
 
-  if (strncmp(in_buf, "qktn", 4)) {
+  if (qtk_header_valid(in_buf, in_size, &data_offset) < 0) {
     printf("File is not a Quicktake 150 picture.\n");
+    ret = 1;
     goto done;
   }
 
-  height = get_uint16_at(in_buf, 544);
-  width  = get_uint16_at(in_buf, 546);
-  type   = get_uint16_at(in_buf, 552);
-  printf("Size: %dx%d, type: %d\n", width, height, type);
-
-  if (width != 640 || height != 480) {
-    printf("Unexpected size.\n");
-    exit(1);
-  }
-  width /= 2;
-  height /= 2;
-
-  if (type == 30) {
-    data_offset = 738;
-  } else {
-    data_offset = 736;
-  }
-  if (qtkn_decode(in_buf + data_offset, &out_buf)) {
+  r = qtkn_decode_len(in_buf + data_offset, in_size - data_offset, &out_buf);
+  if (r == -ENODATA) {
+    printf("Picture is truncated.\n");
+    ret = 1;
+  } else if (r < 0) {
     printf("Error converting picture.\n");
+    ret = 1;
     goto done;
   }
 
-  fwrite(out_buf, 1, qtk_ppm_size(width, height), out_fp);
+  if (out_buf != NULL) {
+    fwrite(out_buf, 1, qtk_ppm_size(320, 240), out_fp);
+  }
 
 done:
   free(out_buf);
   free(in_buf);
-  if (in_fp != NULL) {
+  if (in_fp != NULL && in_fp != stdin) {
     fclose(in_fp);
   }
   if (out_fp != NULL) {
     fclose(out_fp);
   }
+
+  return ret;
 }
@@ -0,0 +1,251 @@
+/* qtk-carve.c
+ *
+ * Copyright 2023, Colin Leroy-Mira <colin@colino.net>
+ *
+ * Find and decode QTKN pictures in raw memory or flash dumps.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+#include "quicktake1x0.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define QTK_MAGIC     "qktn"
+#define QTK_HDR_SIZE  554
+
+static int get_uint16_at(const unsigned char *buf, size_t offset) {
+  return (buf[offset] << 8) | buf[offset+1];
+}
+
+/* Check the header fields at 544-552 of a candidate picture, and return
+ * where its compressed data starts.
+ */
+int qtk_header_valid(const unsigned char *buf, size_t len, size_t *data_offset) {
+  unsigned int width, height, type;
+  size_t offset;
+
+  if (len < QTK_HDR_SIZE || memcmp(buf, QTK_MAGIC, 4))
+    return -EINVAL;
+
+  height = get_uint16_at(buf, 544);
+  width  = get_uint16_at(buf, 546);
+  type   = get_uint16_at(buf, 552);
+
+  if (width != 640 || height != 480)
+    return -EINVAL;
+
+  offset = (type == 30) ? 738 : 736;
+  if (offset > len)
+    return -EINVAL;
+
+  *data_offset = offset;
+  return 0;
+}
+
+/* Return the first "qktn" in [p, end), or NULL. */
+static const unsigned char *find_magic(const unsigned char *p, const unsigned char *end) {
+#ifdef __SSE2__
+  /* Match 'q' and 'k' at consecutive positions sixteen bytes at a time,
+   * and only then check the whole magic. */
+  const __m128i q = _mm_set1_epi8('q');
+  const __m128i k = _mm_set1_epi8('k');
+
+  while (end - p >= 17) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, q),
+                                                        _mm_cmpeq_epi8(b, k)));
+    while (mask) {
+      const unsigned char *c = p + __builtin_ctz(mask);
+      if (end - c >= 4 && !memcmp(c, QTK_MAGIC, 4))
+        return c;
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+  /* libc's memchr is vectorized too; this also handles the tail */
+  while ((p = memchr(p, 'q', end - p)) != NULL) {
+    if (end - p < 4)
+      return NULL;
+    if (!memcmp(p, QTK_MAGIC, 4))
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
+/* Find every valid QTKN header in buf. The offsets array is allocated
+ * and must be freed by the caller. Returns the number of pictures found.
+ */
+size_t qtk_find_headers(const unsigned char *buf, size_t len, size_t **offsets) {
+  const unsigned char *p = buf, *end = buf + len;
+  size_t count = 0, alloc = 0, data_offset;
+
+  *offsets = NULL;
+
+  while ((p = find_magic(p, end)) != NULL) {
+    if (qtk_header_valid(p, end - p, &data_offset) == 0) {
+      if (count == alloc) {
+        size_t *tmp;
+        alloc = alloc ? alloc * 2 : 64;
+        tmp = realloc(*offsets, alloc * sizeof(size_t));
+        if (tmp == NULL)
+          break;
+        *offsets = tmp;
+      }
+      (*offsets)[count++] = p - buf;
+      /* The header itself contains "qktn" strings, skip it */
+      p += data_offset;
+    } else {
+      p++;
+    }
+  }
+
+  return count;
+}
+
+/* Decode one carved picture straight from the mapping. It can not be
+ * longer than the distance to the next header (or the end of the dump). */
+static int carve_one(const unsigned char *buf, size_t len, size_t offset,
+                     const char *out_prefix) {
+  unsigned char *out_buf = NULL;
+  size_t data_offset;
+  char out_name[4096];
+  FILE *out_fp;
+  int r;
+
+  if (qtk_header_valid(buf, len, &data_offset) < 0 || data_offset == len)
+    return -EINVAL;
+
+  r = qtkn_decode_len((unsigned char *)buf + data_offset, len - data_offset, &out_buf);
+  if (r == -ENODATA) {
+    printf("Picture at 0x%zx is truncated.\n", offset);
+    r = 0;
+  } else if (r < 0) {
+    printf("Error converting picture at 0x%zx.\n", offset);
+    goto out;
+  }
+
+  snprintf(out_name, sizeof out_name, "%s_%08zx.pgm", out_prefix, offset);
+  out_fp = fopen(out_name, "wb");
+  if (out_fp == NULL) {
+    printf("Can not open %s: %s\n", out_name, strerror(errno));
+    r = -errno;
+    goto out;
+  }
+  fwrite(out_buf, 1, qtk_ppm_size(320, 240), out_fp);
+  fclose(out_fp);
+
+out:
+  free(out_buf);
+  return r;
+}
+
+/* Decode every jobs-th picture, starting at the first one. */
+static int carve_share(const unsigned char *map, size_t map_len,
+                       const size_t *offsets, size_t count,
+                       size_t first, int jobs, const char *out_prefix) {
+  size_t i;
+  int err = 0;
+
+  for (i = first; i < count; i += jobs) {
+    size_t end = (i + 1 < count) ? offsets[i + 1] : map_len;
+    if (carve_one(map + offsets[i], end - offsets[i], offsets[i], out_prefix) < 0)
+      err = 1;
+  }
+  return err;
+}
+
+/* Find all pictures in a dump and decode them with jobs processes. The
+ * decoder state is global, so each worker is a forked process sharing
+ * the read-only mapping.
+ */
+int qtk_carve_file(const char *path, const char *out_prefix, int jobs) {
+  const unsigned char *map;
+  size_t *offsets = NULL, count;
+  struct stat st;
+  int fd, w, status, failed = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Can not open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    printf("Can not find out file size.\n");
+    close(fd);
+    return -EINVAL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("Can not map %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  count = qtk_find_headers(map, st.st_size, &offsets);
+  printf("Found %zu picture(s).\n", count);
+
+  if (jobs < 1)
+    jobs = 1;
+  if ((size_t)jobs > count)
+    jobs = count;
+
+  /* Don't let the workers inherit pending output */
+  fflush(stdout);
+
+  for (w = 0; w < jobs; w++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      printf("Can not fork: %s, decoding the remaining pictures here\n", strerror(errno));
+      /* Do the share of the workers we could not start */
+      for (; w < jobs; w++) {
+        if (carve_share(map, st.st_size, offsets, count, w, jobs, out_prefix))
+          failed = 1;
+      }
+      break;
+    }
+    if (pid == 0) {
+      int err = carve_share(map, st.st_size, offsets, count, w, jobs, out_prefix);
+      fflush(stdout);
+      _exit(err);
+    }
+  }
+
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed = 1;
+  }
+
+  free(offsets);
+  munmap((void *)map, st.st_size);
+
+  return failed ? -EIO : 0;
+}
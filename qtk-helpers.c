@@ -69,6 +69,7 @@ int qtk_ppm_size(int width, int height) {
 
 unsigned char bitbuf=0;
 unsigned char vbits=0;
+unsigned char input_overrun=0;
 
 void initbithuff(void) {
   /* Consider we won't run out of cache there (at the very start). */
@@ -77,7 +78,13 @@ void initbithuff(void) {
 }
 
 void refill(void) {
-  bitbuf = *(input_buffer++);
+  /* input_end is only set when the caller knows the input size */
+  if (input_end != NULL && input_buffer >= input_end) {
+    bitbuf = 0;
+    input_overrun = 1;
+  } else {
+    bitbuf = *(input_buffer++);
+  }
 
   vbits = 8;
 }
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <string.h>
 #include <sys/param.h>
 
@@ -37,6 +38,14 @@ unsigned char mul_m;
 
 static unsigned char divtable[256];
 
+/* Post-processing settings. The tone curve is composed into divtable
+ * so that it costs nothing per pixel; sharpening runs on a rolling
+ * window of the rows we just decoded, while they're still hot in cache.
+ */
+static unsigned char tone_curve[256];
+static unsigned char tone_curve_set = 0;
+static signed char sharpen_strength = 0;
+
 static void init_divtable(unsigned char factor) {
   unsigned char r = 0;
 
@@ -44,21 +53,64 @@ static void init_divtable(unsigned char factor) {
   do {
     signed short approx = ((r<<8)|0x80)/factor;
 		if (approx < 0) {
-			divtable[r] = 0;
+			divtable[r] = tone_curve[0];
 		} else if (approx > 255) {
-			divtable[r] = 255;
+			divtable[r] = tone_curve[255];
 		} else {
-			divtable[r] = approx;
+			divtable[r] = tone_curve[approx];
 		}
   } while (++r);
 }
 
+static void init_tone_curve(void) {
+	int i;
+
+	if (tone_curve_set)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		tone_curve[i] = i;
+	}
+}
+
+/* Set the tone curve applied to every output pixel: levels first (black
+ * and white points are mapped to 0 and 255), then gamma.
+ * qtkn_set_tone_curve(1.0, 0, 255) restores the identity.
+ */
+int qtkn_set_tone_curve(float gamma, int black, int white) {
+	int i;
+
+	if (!(gamma > 0.0) || black < 0 || white > 255 || black >= white)
+		return -EINVAL;
+
+	for (i = 0; i < 256; i++) {
+		float v = (float)(i - black) / (float)(white - black);
+		v = LIM(v, 0.0, 1.0);
+		tone_curve[i] = (unsigned char)(powf(v, 1.0 / gamma) * 255.0 + 0.5);
+	}
+	tone_curve_set = 1;
+
+	return 0;
+}
+
+/* Set the 3x3 filter strength, from -8 (replace each pixel with the mean
+ * of its neighbours) to 16 (strong sharpening). 0 disables the filter.
+ */
+int qtkn_set_sharpen(int strength) {
+	if (strength < -8 || strength > 16)
+		return -EINVAL;
+
+	sharpen_strength = strength;
+	return 0;
+}
+
 #define BUF_SIZE FINAL_WIDTH+2
 unsigned char huff_ctrl[9*2][256];
 unsigned char huff_data[9][256];
 
 signed short next_line[BUF_SIZE];
 unsigned char *input_buffer;
+unsigned char *input_end;
 unsigned char *header;
 unsigned int output_len;
 unsigned char last_m = 16;
@@ -137,7 +189,7 @@ static void init_huff(void) {
   }
 }
 
-static void init_decoder(void) {
+void init_decoder(void) {
 	unsigned short c, i, s;
 	/* Huff tables initializer */
 	static const char src[] = {
@@ -167,26 +219,33 @@ static void init_decoder(void) {
 
 	output_len = qtk_ppm_size(FINAL_WIDTH, FINAL_HEIGHT);
 
-	output = malloc((size_t)FINAL_WIDTH * (size_t)FINAL_HEIGHT);
+	output = calloc(1, (size_t)FINAL_WIDTH * (size_t)FINAL_HEIGHT);
 	if (output == NULL) {
 		free(header);
 		exit(1);
 	}
 
 	init_huff();
+	init_tone_curve();
 
-	/* Init the bitbuffer */
-	initbithuff();
+	/* Reset the scale state, in case we decode more than one picture */
+	last_m = 16;
+	input_overrun = 0;
 
 	for (i=0; i < BUF_SIZE; i++) {
 		next_line[i] = 2048;
 	}
-
-	output_line = output - FINAL_WIDTH;
 }
 
-static void finalize_decoder(unsigned char **out) {
+void finalize_decoder(unsigned char **out) {
 	unsigned char *ptr;
+
+	if (out == NULL) {
+		free(header);
+		free(output);
+		return;
+	}
+
 	*out = calloc(1, output_len);
 	if (*out == NULL) {
 		free(header);
@@ -201,8 +260,15 @@ static void finalize_decoder(unsigned char **out) {
 	free(output);
 }
 
-static void init_row(void) {
-	static unsigned short val_from_last[256] = {
+void rescale_next_line(unsigned short val) {
+	unsigned short i;
+
+	for (i=0; i < BUF_SIZE; i++) {
+		next_line[i] = (next_line[i] * val - 1) >> 8;
+	}
+}
+
+static const unsigned short val_from_last[256] = {
 	  0x0000, 0x1000, 0x0800, 0x0555, 0x0400, 0x0333, 0x02ab, 0x0249, 0x0200, 0x01c7, 0x019a, 0x0174, 0x0155, 0x013b, 0x0125, 0x0111, 0x0100,
 	  0x00f1, 0x00e4, 0x00d8, 0x00cd, 0x00c3, 0x00ba, 0x00b2, 0x00ab, 0x00a4, 0x009e, 0x0098, 0x0092, 0x008d, 0x0089, 0x0084, 0x0080,
 	  0x007c, 0x0078, 0x0075, 0x0072, 0x006f, 0x006c, 0x0069, 0x0066, 0x0064, 0x0062, 0x005f, 0x005d, 0x005b, 0x0059, 0x0057, 0x0055,
@@ -219,26 +285,39 @@ static void init_row(void) {
 	  0x0014, 0x0014, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0013, 0x0012, 0x0012, 0x0012,
 	  0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0012, 0x0011, 0x0011, 0x0011, 0x0011, 0x0011, 0x0011,
 	  0x0011, 0x0011, 0x0011, 0x0011, 0x0011, 0x0011, 0x0011, 0x0011, 0x0010, 0x0010, 0x0010, 0x0010, 0x0010, 0x0010, 0x0010
-	};
-	unsigned short val, i;
+};
+
+/* Scale to apply to next_line when going from last_m to mul. */
+unsigned short row_scale(unsigned char mul) {
+	unsigned short val;
 
+	val = (val_from_last[last_m] * mul) >> 4;
+	last_m = mul;
+
+	return val;
+}
+
+/* Returns -ENODATA if the input ended, or -EINVAL if the row's
+ * multiplier is zero (corrupt data, it would divide by zero). */
+int init_row(void) {
 	mul_m = getbits6();
 	/* Ignore the two next ones */
 	getbits6();
 	getbits6();
 
+	if (input_overrun)
+		return -ENODATA;
+	if (mul_m == 0)
+		return -EINVAL;
+
 	/* Init the div table to ease setting each value */
 	init_divtable(mul_m);
 
-	val = (val_from_last[last_m] * mul_m) >> 4;
-	last_m = mul_m;
-
-	for (i=0; i < BUF_SIZE; i++) {
-		next_line[i] = (next_line[i] * val - 1) >> 8;
-	}
+	rescale_next_line(row_scale(mul_m));
+	return 0;
 }
 
-static void decode_row(void) {
+void decode_row(void) {
 	int col, tree, nreps, rep, step, r;
 	signed short val1, val0;
 
@@ -256,11 +335,11 @@ static void decode_row(void) {
 					unsigned char token;
 					token = (unsigned char) getdatahuff8();
 					val1 = token * mul_m;
-					output_line[col+1] = token;
+					output_line[col+1] = tone_curve[token];
 
 					token = (unsigned char) getdatahuff8();
 					val0 = token * mul_m;
-					output_line[col] = token;
+					output_line[col] = tone_curve[token];
 
 					token = (unsigned char) getdatahuff8();
 					next_line[col+2] = token * mul_m;
@@ -331,7 +410,7 @@ static void decode_row(void) {
 	}
 }
 
-static void discard_data(void) {
+void discard_data(void) {
 	int col, tree, nreps, rep, r;
 
   /* Consume RADC tokens but discard them. */
@@ -368,21 +447,264 @@ static void discard_data(void) {
 		}
 	}
 }
+static unsigned char sharpen_buf[2][FINAL_WIDTH];
+static unsigned char *sharpen_above, *sharpen_cur;
+
+static inline unsigned char sharpen_px(const unsigned char *above,
+																			 const unsigned char *cur,
+																			 const unsigned char *below,
+																			 int l, int x, int r) {
+	int sum, v;
+
+	sum = above[l] + above[x] + above[r]
+			+ cur[l] + cur[r]
+			+ below[l] + below[x] + below[r];
+	v = cur[x] + (sharpen_strength * ((cur[x] << 3) - sum)) / 64;
+
+	return LIM(v, 0, 255);
+}
+
+/* Filter one line. above and cur are unfiltered copies, below is the
+ * next output line which has not been filtered yet. Edges are replicated.
+ */
+static void sharpen_line(unsigned char *dst,
+												 const unsigned char *above,
+												 const unsigned char *cur,
+												 const unsigned char *below) {
+	int x;
+
+	dst[0] = sharpen_px(above, cur, below, 0, 0, 1);
+	for (x = 1; x < FINAL_WIDTH - 1; x++) {
+		dst[x] = sharpen_px(above, cur, below, x-1, x, x+1);
+	}
+	dst[x] = sharpen_px(above, cur, below, x-1, x, x);
+}
+
+/* Sharpen the lines preceding the two we just decoded. Each line is only
+ * filtered once the line below it is available, so we lag by one line.
+ */
+/* Filter the last decoded line, replicating it as its own bottom
+ * neighbour. Also used when the picture stops early. */
+static void sharpen_last_line(int last) {
+	sharpen_line(output + last * FINAL_WIDTH, sharpen_above, sharpen_cur, sharpen_cur);
+}
+
+static void sharpen_rows(unsigned char row) {
+	unsigned char *line = output + row * FINAL_WIDTH;
+	unsigned char *tmp;
+	int y;
+
+	for (y = 0; y < 2; y++, line += FINAL_WIDTH) {
+		if (row + y == 0) {
+			sharpen_above = sharpen_buf[0];
+			sharpen_cur = sharpen_buf[1];
+			memcpy(sharpen_above, line, FINAL_WIDTH);
+			memcpy(sharpen_cur, line, FINAL_WIDTH);
+			continue;
+		}
+		sharpen_line(line - FINAL_WIDTH, sharpen_above, sharpen_cur, line);
+
+		tmp = sharpen_above;
+		sharpen_above = sharpen_cur;
+		sharpen_cur = tmp;
+		memcpy(sharpen_cur, line, FINAL_WIDTH);
+	}
+
+	if (row + 2 == FINAL_HEIGHT)
+		sharpen_last_line(row + 1);
+}
+
+/* Decode the two output lines starting at row, and discard the
+ * two next input lines (we only output half the height). */
+static int decode_row_pair(unsigned char row) {
+	int r;
+
+	output_line = output + (row - 1) * FINAL_WIDTH;
+
+	r = init_row();
+	if (r < 0)
+		return r;
+
+	decode_row();
+	discard_data();
+	return 0;
+}
+
+/* Decode a QTKN picture that is no longer than len bytes. Reading past
+ * the end feeds zeroes to the decoder instead of overflowing the buffer;
+ * the picture is still output but -ENODATA is returned.
+ */
+int qtkn_decode_len(unsigned char *raw, size_t len, unsigned char **out) {
+	int r;
+
+	if (len == 0)
+		return -ENODATA;
+
+	input_end = raw + len;
+	r = qtkn_decode(raw, out);
+	input_end = NULL;
+
+	if (r == 0 && input_overrun)
+		return -ENODATA;
+	return r;
+}
+
 int qtkn_decode(unsigned char *raw, unsigned char **out) {
 	unsigned char row;
+	int r = 0;
 
 	input_buffer = raw;
 
 	init_decoder();
 
+	/* Init the bitbuffer */
+	initbithuff();
+
 	for (row=0; row < FINAL_HEIGHT; row+=2) {
-		init_row();
+		/* Out of data, leave the rest of the picture blank */
+		if (input_overrun) {
+			r = -ENODATA;
+			break;
+		}
 
-		decode_row();
-		discard_data();
+		r = decode_row_pair(row);
+		if (r < 0)
+			break;
+
+		if (sharpen_strength)
+			sharpen_rows(row);
 	}
 
+	/* Stopped early, the last decoded line is still unfiltered */
+	if (sharpen_strength && row > 0 && row < FINAL_HEIGHT)
+		sharpen_last_line(row - 1);
+
 	finalize_decoder(out);
 
+	return r;
+}
+
+/* Incremental decoding, for data arriving slowly (e.g. over the serial
+ * line). Input is accumulated in stream_buf, and the bit reader state is
+ * saved after each row pair. When a row pair runs out of input, its
+ * state is rolled back and it is decoded again once more data arrived.
+ */
+static unsigned char *stream_buf;
+static size_t stream_len, stream_alloc, stream_pos;
+static unsigned char stream_bitbuf, stream_vbits;
+static unsigned char stream_row;
+
+int qtkn_stream_init(void) {
+	init_decoder();
+
+	stream_buf = NULL;
+	stream_len = stream_alloc = stream_pos = 0;
+	stream_bitbuf = stream_vbits = 0;
+	stream_row = 0;
+
+	return 0;
+}
+
+static void stream_emit_rows(unsigned char row, qtkn_row_cb cb, void *cb_data) {
+	int first = row, last = row + 1;
+
+	/* Sharpening lags one line behind */
+	if (sharpen_strength) {
+		first = row ? row - 1 : 0;
+		last = (row + 2 == FINAL_HEIGHT) ? row + 1 : row;
+	}
+
+	for (; first <= last; first++) {
+		cb(output + first * FINAL_WIDTH, first, FINAL_WIDTH, cb_data);
+	}
+}
+
+/* Push len more bytes of compressed data, and call cb for every output
+ * line that could be decoded. Returns QTKN_NEED_MORE_DATA until the whole
+ * picture is decoded, then 0, or -EINVAL if the data is corrupt.
+ */
+int qtkn_stream_push(const unsigned char *data, size_t len,
+										 qtkn_row_cb cb, void *cb_data) {
+	signed short saved_line[BUF_SIZE];
+	unsigned char saved_m;
+	int r;
+
+	if (stream_row >= FINAL_HEIGHT)
+		return 0;
+
+	/* Drop what we already consumed before growing the buffer */
+	if (stream_pos > 0 && stream_len + len > stream_alloc) {
+		memmove(stream_buf, stream_buf + stream_pos, stream_len - stream_pos);
+		stream_len -= stream_pos;
+		stream_pos = 0;
+	}
+	if (stream_len + len > stream_alloc) {
+		unsigned char *tmp;
+		size_t new_alloc = MAX(stream_alloc * 2, stream_len + len);
+
+		tmp = realloc(stream_buf, new_alloc);
+		if (tmp == NULL)
+			return -ENOMEM;
+		stream_buf = tmp;
+		stream_alloc = new_alloc;
+	}
+	memcpy(stream_buf + stream_len, data, len);
+	stream_len += len;
+
+	while (stream_row < FINAL_HEIGHT) {
+		/* A row pair needs more than the bits left in bitbuf */
+		if (stream_pos == stream_len)
+			return QTKN_NEED_MORE_DATA;
+
+		memcpy(saved_line, next_line, sizeof(next_line));
+		saved_m = last_m;
+
+		input_buffer = stream_buf + stream_pos;
+		input_end = stream_buf + stream_len;
+		input_overrun = 0;
+		bitbuf = stream_bitbuf;
+		vbits = stream_vbits;
+
+		r = decode_row_pair(stream_row);
+
+		input_end = NULL;
+		if (input_overrun) {
+			memcpy(next_line, saved_line, sizeof(next_line));
+			last_m = saved_m;
+			return QTKN_NEED_MORE_DATA;
+		}
+		if (r < 0)
+			return r;
+
+		stream_pos = input_buffer - stream_buf;
+		stream_bitbuf = bitbuf;
+		stream_vbits = vbits;
+
+		if (sharpen_strength)
+			sharpen_rows(stream_row);
+		if (cb)
+			stream_emit_rows(stream_row, cb, cb_data);
+
+		stream_row += 2;
+	}
+
 	return 0;
 }
+
+/* Release the stream, and output the picture if out is not NULL.
+ * Returns -ENODATA if the picture is incomplete.
+ */
+int qtkn_stream_finish(unsigned char **out) {
+	int r = (stream_row < FINAL_HEIGHT) ? -ENODATA : 0;
+
+	free(stream_buf);
+	stream_buf = NULL;
+	stream_len = stream_alloc = stream_pos = 0;
+
+	if (sharpen_strength && stream_row > 0 && stream_row < FINAL_HEIGHT)
+		sharpen_last_line(stream_row - 1);
+
+	finalize_decoder(out);
+
+	return r;
+}
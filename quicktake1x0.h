@@ -21,6 +21,8 @@
 #ifndef CAMLIBS_QUICKTAKE_1X0_H
 #define CAMLIBS_QUICKTAKE_1X0_H
 
+#include <stddef.h>
+
 #define CHECK_RESULT(result) {int r = result; if (r < 0) return (r);}
 
 typedef enum {
@@ -72,11 +74,34 @@ int qtk_ppm_size(int width, int height);
 int qtk_thumbnail_decode(unsigned char *raw, unsigned char **out, Quicktake1x0Model model);
 int qtkt_decode(unsigned char *raw, int width, int height, unsigned char **out);
 int qtkn_decode(unsigned char *raw, unsigned char **out);
+int qtkn_decode_len(unsigned char *raw, size_t len, unsigned char **out);
+
+/* Incremental QTKN decoding */
+#define QTKN_NEED_MORE_DATA 1
+typedef void (*qtkn_row_cb)(const unsigned char *line, int row, int width, void *data);
+
+int qtkn_stream_init(void);
+int qtkn_stream_push(const unsigned char *data, size_t len,
+                     qtkn_row_cb cb, void *cb_data);
+int qtkn_stream_finish(unsigned char **out);
+
+/* QTKN post-processing, applied while decoding */
+int qtkn_set_tone_curve(float gamma, int black, int white);
+int qtkn_set_sharpen(int strength);
+
+/* Carving QTKN pictures out of raw memory dumps */
+int qtk_header_valid(const unsigned char *buf, size_t len, size_t *data_offset);
+size_t qtk_find_headers(const unsigned char *buf, size_t len, size_t **offsets);
+int qtk_carve_file(const char *path, const char *out_prefix, int jobs);
 
 extern unsigned char *input_buffer;
+extern unsigned char *input_end;
+extern unsigned char input_overrun;
+extern unsigned char bitbuf, vbits;
 extern unsigned char huff_ctrl[9*2][256];
 extern unsigned char huff_data[9][256];
 
+unsigned char getbit (void);
 unsigned char getbits6 (void);
 unsigned char getctrlhuff (unsigned char huff_num);
 unsigned char getdatahuff (unsigned char huff_num);
@@ -84,6 +109,18 @@ unsigned char getdatahuff8 (void);
 
 void initbithuff (void);
 
+/* QTKN decoder internals, exposed for the benchmarks */
+extern unsigned char *output, *output_line;
+extern unsigned char mul_m;
+
+void init_decoder(void);
+void finalize_decoder(unsigned char **out);
+int init_row(void);
+unsigned short row_scale(unsigned char mul);
+void rescale_next_line(unsigned short val);
+void decode_row(void);
+void discard_data(void);
+
 #define ABS(x) (((int)(x) ^ ((int)(x) >> 31)) - ((int)(x) >> 31))
 #define LIM(x,min,max) MAX(min,MIN(x,max))
 #define getbits(n, raw) getbithuff(n, raw, 0)